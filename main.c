@@ -37,12 +37,20 @@
 #include "util.h"
 
 #include <stdint.h>
+#include <stddef.h>
+#include <string.h>
 #include <avr/io.h>
+#include <avr/eeprom.h>
 #include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include <avr/sleep.h>
 #include <avr/wdt.h>
 
-#define CPU_HZ			MHz(20)
-//#define CPU_HZ			MHz(16)
+/* The CPU clock is selected with  make CPU_MHZ=x */
+#ifndef CPU_MHZ
+# define CPU_MHZ		20
+#endif
+#define CPU_HZ			MHz(CPU_MHZ)
 
 #define MHz(hz)			(1000000ul * (hz))
 
@@ -56,21 +64,25 @@
 #ifdef TIFR
 # define TIFR1		TIFR
 #endif
+#ifndef EEPE
+# define EEPE		EEWE
+# define EEMPE		EEMWE
+#endif
+#if !defined(EE_READY_vect) && defined(EE_RDY_vect)
+# define EE_READY_vect	EE_RDY_vect
+#endif
 
 
 /**
  * struct input_pin - An input pin definition
  *
  * @input_port:		The signal input port. PORTB, PORTC, ...
- * @input_pin:		The signal input pin. PINB, PINC, ...
- * @input_ddr:		Data direction register for input_port.
+ *			The PINx and DDRx registers are derived from it.
  * @input_bit:		The bit number on the input_port.
  * @flags:		See enum input_pin_flags.
  */
 struct input_pin {
-	uint16_t input_port;
-	uint16_t input_pin;
-	uint16_t input_ddr;
+	uint8_t input_port;
 	uint8_t input_bit;
 	uint8_t flags;
 };
@@ -79,23 +91,36 @@ struct input_pin {
  *
  * @INPUT_PULLUP:	Use pullups for the input pin.
  * @INPUT_INVERT:	Logically invert the input signal.
+ * @INPUT_CATCH:	Catch pulses shorter than a scan pass with the
+ *			pin change interrupt. Needs PULSE_CATCH.
+ *			A caught pulse bypasses the ACTIVE_TIME filtering
+ *			entirely: it is taken immediately and the output is
+ *			held for at least the DWELL_TIME. So a single noise
+ *			spike that the interrupt sees asserts the output.
+ *			Polled samples are still filtered. Only use this for
+ *			index marks that are too short to be polled.
+ * @INPUT_PAIR:		This input and the input of the next connection
+ *			are the two channels of one redundant contact.
+ *			Their debounced states must agree within the
+ *			DISCREPANCY_TIME. Otherwise we go into major_fault().
  */
 enum input_pin_flags {
 	INPUT_PULLUP		= (1 << 0),
 	INPUT_INVERT		= (1 << 1),
+	INPUT_CATCH		= (1 << 2),
+	INPUT_PAIR		= (1 << 3),
 };
 
 /**
  * struct output_pin - Level triggered output pin
  *
  * @output_port:	The signal output port. PORTB, PORTC, ...
- * @output_ddr:		Data direction register for output_port.
+ *			The DDRx register is derived from it.
  * @output_bit:		The bit number on the output_port.
  * @flags:		See enum output_pin_flags.
  */
 struct output_pin {
-	uint16_t output_port;
-	uint16_t output_ddr;
+	uint8_t output_port;
 	uint8_t output_bit;
 	uint8_t flags;
 
@@ -106,9 +131,12 @@ struct output_pin {
  * enum output_pin_flags - Flags for an output pin
  *
  * @OUTPUT_INVERT:	Logically invert the output signal.
+ * @OUTPUT_SAFE:	Assert the output in the safe state.
+ *			See emergency_shutdown().
  */
 enum output_pin_flags {
 	OUTPUT_INVERT		= (1 << 0),
+	OUTPUT_SAFE		= (1 << 1),
 };
 
 /**
@@ -116,20 +144,23 @@ enum output_pin_flags {
  *
  * @in:		Definition of the input pin.
  * @out:	Pointer to the output pin.
+ *
+ * This is the constant part only. The runtime state
+ * lives in struct connection_state.
  */
 struct connection {
 	struct input_pin in;
 	struct output_pin *out;
-
-	bool input_is_asserted;
-	uint32_t dwell_timeout;
 };
 
+/* The PINx and DDRx registers are located right below PORTx.
+ * Only ports in the lower 256 bytes of the address space are supported. */
+#define PORT_TO_PIN(port_addr)	((port_addr) - 2)
+#define PORT_TO_DDR(port_addr)	((port_addr) - 1)
+
 #define DEF_INPUT(portid, bit, _flags)				\
 	.in = {							\
 		.input_port	= _SFR_ADDR(PORT##portid),	\
-		.input_pin	= _SFR_ADDR(PIN##portid),	\
-		.input_ddr	= _SFR_ADDR(DDR##portid),	\
 		.input_bit	= bit,				\
 		.flags		= _flags			\
 	}
@@ -137,7 +168,6 @@ struct connection {
 #define DEF_OUTPUT(portid, bit, _flags)				\
 	struct output_pin output_pin_##portid##bit = {		\
 		.output_port	= _SFR_ADDR(PORT##portid),	\
-		.output_ddr	= _SFR_ADDR(DDR##portid),	\
 		.output_bit	= bit,				\
 		.flags		= _flags,			\
 	}
@@ -153,12 +183,204 @@ struct connection {
 # error "See  make help  for more information"
 #endif
 
-/* Override dwell times in debugging mode. */
-#if DEBUG
-# undef DEBOUNCE_DWELL_TIME
-# define DEBOUNCE_DWELL_TIME	MSEC_TO_USEC(4000)
-# undef DEBOUNCE_ACTIVE_TIME
-# define DEBOUNCE_ACTIVE_TIME	MSEC_TO_USEC(2000)
+#define TEST_PORT		concat(PORT, TEST_PORTID)
+#define TEST_DDR		concat(DDR, TEST_PORTID)
+
+#define __DEF_OUTPUT(portid, bit, _flags)			\
+	static DEF_OUTPUT(portid, bit, _flags);
+TARGET_OUTPUTS(__DEF_OUTPUT)
+
+#define __DEF_CONNECTION(portid, bit, _flags, outpin)		\
+	{							\
+		DEF_INPUT(portid, bit, _flags),			\
+		.out = &output_pin_##outpin,			\
+	},
+static const struct connection connections[] = {
+	TARGET_CONNECTIONS(__DEF_CONNECTION)
+};
+
+/* Compile time pin conflict detection.
+ * Every used pin is claimed by an enumerator named pin_claim_<port><bit>.
+ * A pin that is used twice fails to compile with
+ * "redeclaration of enumerator 'pin_claim_...'".
+ * Outputs may be shared by several connections, but inputs may not. */
+#define __PIN_CLAIM(portid, bit)	pin_claim_##portid##bit,
+#define PIN_CLAIM(portid, bit)		__PIN_CLAIM(portid, bit)
+#define __CLAIM_INPUT(portid, bit, _flags, outpin)	PIN_CLAIM(portid, bit)
+#define __CLAIM_OUTPUT(portid, bit, _flags)		PIN_CLAIM(portid, bit)
+enum pin_claims {
+	TARGET_CONNECTIONS(__CLAIM_INPUT)
+	TARGET_OUTPUTS(__CLAIM_OUTPUT)
+	PIN_CLAIM(TEST_PORTID, TEST_BIT)
+};
+
+/* All input flags used by the target ORed together.
+ * This is used to compile out unused features. */
+#define __INPUT_FLAGS(portid, bit, _flags, outpin)	| (_flags)
+enum {
+	TARGET_INPUT_FLAGS = 0 TARGET_CONNECTIONS(__INPUT_FLAGS)
+};
+
+/* The connection number of each input pin as connection_nr_<port><bit>.
+ * These are used for compile time checks of the connection table. */
+#define __CONNECTION_NR(portid, bit, _flags, outpin)	connection_nr_##portid##bit,
+enum connection_nrs {
+	TARGET_CONNECTIONS(__CONNECTION_NR)
+};
+
+/* Bitmap of the INPUT_PAIR connections. Only valid for the first 64. */
+#define __PAIR_BIT(portid, bit, _flags, outpin)				\
+	| (((_flags) & INPUT_PAIR) ? U64(1) << (connection_nr_##portid##bit & 63) : 0)
+#define TARGET_PAIR_MASK	(U64(0) TARGET_CONNECTIONS(__PAIR_BIT))
+#define __CHECK_PAIR(portid, bit, _flags, outpin)			\
+	compiletime_assert(!((_flags) & INPUT_PAIR) ||			\
+			   connection_nr_##portid##bit < 64,		\
+			   "INPUT_PAIR is only supported on the first 64 connections"); \
+	compiletime_assert(!((_flags) & INPUT_PAIR) ||			\
+			   connection_nr_##portid##bit < NR_CONNECTIONS - 1, \
+			   "The last connection has INPUT_PAIR, but no second channel");
+
+/* Time dilation.
+ * The jiffies run TIME_DILATION times slower than real time. All timing
+ * constants and all code stay the same as in production. The firmware
+ * just runs in slow motion, so the timing can be watched in debugging
+ * mode. Possible values are 1, 8, 32 and 128 (timer prescaler). */
+#ifndef TIME_DILATION
+# if DEBUG
+#  define TIME_DILATION		32
+# else
+#  define TIME_DILATION		1
+# endif
+#endif
+
+/* Pulse catching.
+ * PULSE_CATCH builds the pin change interrupt handlers for the
+ * INPUT_CATCH inputs. The target must set it, if it uses INPUT_CATCH,
+ * and must not set it otherwise. */
+#ifndef PULSE_CATCH
+# define PULSE_CATCH		0
+#endif
+#if PULSE_CATCH && !defined(PCICR)
+# error "PULSE_CATCH needs pin change interrupts"
+#endif
+
+/* Event storm protection.
+ * An input that toggles at least STORM_EDGE_THRESHOLD times within
+ * STORM_WINDOW is assumed to be broken (chattering cable, etc...).
+ * It is demoted to be sampled on every STORM_SCAN_DIVIDER'th scan pass
+ * only, so it can't steal scan time from the other inputs.
+ * The input is promoted again as soon as it calmed down.
+ * Unit for STORM_WINDOW is microseconds. */
+#ifndef STORM_WINDOW
+# define STORM_WINDOW		MSEC_TO_USEC(10)
+#endif
+#ifndef STORM_EDGE_THRESHOLD
+# define STORM_EDGE_THRESHOLD	32
+#endif
+#ifndef STORM_SCAN_DIVIDER
+# define STORM_SCAN_DIVIDER	16
+#endif
+#if (STORM_SCAN_DIVIDER & (STORM_SCAN_DIVIDER - 1)) != 0
+# error "STORM_SCAN_DIVIDER must be a power of two"
+#endif
+
+/* The maximum time the two channels of an INPUT_PAIR
+ * may disagree. Unit is microseconds. */
+#ifndef DISCREPANCY_TIME
+# define DISCREPANCY_TIME	MSEC_TO_USEC(20)
+#endif
+
+/* Actuation counters (odometers) of the connections in EEPROM.
+ * The counters are written to a wear-leveled ring of records in the
+ * EEPROM area at ODOMETER_EEPROM_BASE of ODOMETER_EEPROM_SIZE bytes.
+ * Changes are coalesced and flushed at most every ODOMETER_FLUSH_TIME.
+ * The rest of the EEPROM is left for other persistent data.
+ * The first EEPROM cells are skipped. They are the most likely to be
+ * corrupted by a write during a brown-out.
+ * This is opt-in. Only enable it with the brown-out detector enabled
+ * in the fuses (see the Makefile).
+ * Unit for ODOMETER_FLUSH_TIME is microseconds. */
+#ifndef ODOMETER
+# define ODOMETER		0
+#endif
+#ifndef ODOMETER_EEPROM_BASE
+# define ODOMETER_EEPROM_BASE	32
+#endif
+#ifndef ODOMETER_EEPROM_SIZE
+# define ODOMETER_EEPROM_SIZE	256
+#endif
+#ifndef ODOMETER_FLUSH_TIME
+# define ODOMETER_FLUSH_TIME	MSEC_TO_USEC(10ul * 60 * 1000)
+#endif
+
+/* The time an output pin may differ from its driven level.
+ * This covers the input synchronizer and the load capacitance.
+ * Unit is microseconds. */
+#ifndef READBACK_FILTER_TIME
+# define READBACK_FILTER_TIME	MSEC_TO_USEC(2)
+#endif
+
+/* Adaptive sampling.
+ * If no input changed for SAMPLE_BURST_TIME, the scan loop sleeps
+ * for SAMPLE_IDLE_PERIOD between the passes. Any input activity switches
+ * back to maximum rate sampling for at least SAMPLE_BURST_TIME.
+ * A SAMPLE_IDLE_PERIOD of 0 disables adaptive sampling.
+ * Units for SAMPLE_IDLE_PERIOD and SAMPLE_BURST_TIME are microseconds. */
+#ifndef SAMPLE_IDLE_PERIOD
+# define SAMPLE_IDLE_PERIOD	0
+#endif
+#ifndef SAMPLE_BURST_TIME
+# define SAMPLE_BURST_TIME	MSEC_TO_USEC(50)
+#endif
+
+/* Trace points.
+ * TRACE is a bitmask of the trace events (1 << TRACE_xxx) to emit as
+ * pulse codes on the test pin. Disabled events compile to nothing.
+ * TRACE_GAP_CYCLES is the minimum low time after a code. It separates
+ * the codes for the decoder (tracedecode.py). */
+#ifndef TRACE
+# define TRACE			0
+#endif
+#ifndef TRACE_GAP_CYCLES
+# define TRACE_GAP_CYCLES	16
+#endif
+
+/* Watchdog supervision.
+ * The watchdog is kicked once per completed scan pass, if the pass
+ * took no more than SUPERVISE_PASS_BUDGET CPU cycles (idle sleep
+ * excluded) and all supervised interrupts made progress within the
+ * last SUPERVISE_ISR_WINDOW. Unit for SUPERVISE_ISR_WINDOW is
+ * microseconds.
+ * A pass is faster than a jiffy with high TIME_DILATION. So the time base
+ * only counts as stalled, if the jiffies did not advance for
+ * SUPERVISE_STALL_PASSES passes in a row. A pass takes at least 64 cycles.
+ * TIME_DILATION stretches the idle sleep and SUPERVISE_ISR_WINDOW in real
+ * time, but not the hardware watchdog timeout SUPERVISE_WDT_TIMEOUT.
+ * Debug builds don't enable the watchdog. */
+#define SUPERVISE_WDT_TIMEOUT	MSEC_TO_USEC(500) /* WDTO_500MS */
+#ifndef SUPERVISE_PASS_BUDGET
+# define SUPERVISE_PASS_BUDGET	(4 * SCAN_WORST_PASS_CYCLES)
+#endif
+#ifndef SUPERVISE_ISR_WINDOW
+# define SUPERVISE_ISR_WINDOW	MSEC_TO_USEC(50)
+#endif
+#ifndef SUPERVISE_STALL_PASSES
+# define SUPERVISE_STALL_PASSES	(2 + JIFFY_CYCLES / 64)
+#endif
+
+/* PC sampling profiler.
+ * Timer 0 samples the interrupted program counter PROFILE_HZ times per
+ * second and bins it by function. The overhead grows linearly with
+ * PROFILE_HZ. It is reported in struct profile.
+ * Build with  make PROFILE=1  to generate the symbol table. */
+#ifndef PROFILE
+# define PROFILE		0
+#endif
+#ifndef PROFILE_HZ
+# define PROFILE_HZ		1000
+#endif
+#ifndef PROFILE_MAX_SYMBOLS
+# define PROFILE_MAX_SYMBOLS	32 /* Must be a power of two */
 #endif
 
 #define MMIO8(mem_addr)		_MMIO_BYTE(mem_addr)
@@ -167,19 +389,35 @@ struct connection {
 
 
 
-/* System timer calibration. */
+/* System timer calibration.
+ * JIFFIES_PER_SECOND is per dilated second. */
 #if CPU_HZ == MHz(20)
-# define SYSTIMER_TIMERFREQ	(1 << CS11) /* == CPU_HZ/8 */
 # define JIFFIES_PER_SECOND	U64(2500000)
 #elif CPU_HZ == MHz(16)
-# define SYSTIMER_TIMERFREQ	(1 << CS11) /* == CPU_HZ/8 */
 # define JIFFIES_PER_SECOND	U64(2000000)
 #else
 # error "No timer calibration for the selected CPU frequency available."
 #endif
+#if TIME_DILATION == 1
+# define SYSTIMER_TIMERFREQ	(1 << CS11) /* == CPU_HZ/8 */
+#elif TIME_DILATION == 8
+# define SYSTIMER_TIMERFREQ	((1 << CS11) | (1 << CS10)) /* == CPU_HZ/64 */
+#elif TIME_DILATION == 32
+# define SYSTIMER_TIMERFREQ	(1 << CS12) /* == CPU_HZ/256 */
+#elif TIME_DILATION == 128
+# define SYSTIMER_TIMERFREQ	((1 << CS12) | (1 << CS10)) /* == CPU_HZ/1024 */
+#else
+# error "TIME_DILATION must be 1, 8, 32 or 128."
+#endif
 /* Convert values to jiffies. (Expensive on non-const values!) */
 #define MSEC_TO_JIFFIES(msec)	U32(U64(msec) * JIFFIES_PER_SECOND / U64(1000))
 #define USEC_TO_JIFFIES(usec)	U32(U64(usec) * JIFFIES_PER_SECOND / U64(1000000))
+/* Real CPU cycles per jiffy. */
+#define JIFFY_CYCLES		U32(U64(CPU_HZ) * TIME_DILATION / JIFFIES_PER_SECOND)
+/* Convert real CPU cycles to jiffies, rounded up. (Expensive on non-const values!) */
+#define CYCLES_TO_JIFFIES(cycles)	U32((U64(cycles) * JIFFIES_PER_SECOND + \
+					     U64(CPU_HZ) * TIME_DILATION - 1) / \
+					    (U64(CPU_HZ) * TIME_DILATION))
 /* Convert time values. (Expensive on non-const values!) */
 #define USEC_TO_MSEC(usec)	U64(U64(usec) / U64(1000))
 #define MSEC_TO_USEC(msec)	U64(U64(msec) * U64(1000))
@@ -199,12 +437,16 @@ struct connection {
 /* Upper 16-bit half of the jiffies counter.
  * The lower half is the hardware timer counter. */
 static uint16_t jiffies_high16;
+/* Number of 32-bit jiffies wraps. This is the carry out of
+ * jiffies_high16. It is only read by get_uptime(). */
+static uint32_t jiffies_wraps;
 
 /* Timer 1 overflow IRQ handler.
  * This handler is executed on overflow of the (low) hardware part of
  * the jiffies counter. It does only add 0x10000 to the 32bit software
  * counter. So it basically adds 1 to the high 16bit software part of
- * the counter. */
+ * the counter. The carry out of that goes to jiffies_wraps.
+ * Subtracting -1 leaves the carry (borrow) flag clear only on the wrap. */
 
 #define JIFFY_ISR_NAME	stringify(TIMER1_OVF_vect)
 __asm__(
@@ -220,6 +462,20 @@ JIFFY_ISR_NAME ":			\n"
 "	lds r16, jiffies_high16 + 1	\n"
 "	sbci r16, hi8(-1)		\n"
 "	sts jiffies_high16 + 1, r16	\n"
+"	brcs 1f				\n"
+"	lds r16, jiffies_wraps + 0	\n"
+"	subi r16, lo8(-1)		\n"
+"	sts jiffies_wraps + 0, r16	\n"
+"	lds r16, jiffies_wraps + 1	\n"
+"	sbci r16, hi8(-1)		\n"
+"	sts jiffies_wraps + 1, r16	\n"
+"	lds r16, jiffies_wraps + 2	\n"
+"	sbci r16, hlo8(-1)		\n"
+"	sts jiffies_wraps + 2, r16	\n"
+"	lds r16, jiffies_wraps + 3	\n"
+"	sbci r16, hhi8(-1)		\n"
+"	sts jiffies_wraps + 3, r16	\n"
+"1:					\n"
 "	pop r16				\n"
 "	out __SREG__, r0		\n"
 "	pop r0				\n"
@@ -236,7 +492,8 @@ static uint32_t get_jiffies(void)
 	irq_disable();
 	while (1) {
 		if (unlikely(TIFR1 & (1 << TOV1))) {
-			jiffies_high16++;
+			if (unlikely(++jiffies_high16 == 0))
+				jiffies_wraps++;
 			TIFR1 |= (1 << TOV1); /* Clear it */
 		}
 		mb();
@@ -252,6 +509,32 @@ static uint32_t get_jiffies(void)
 	return ((((uint32_t)high) << 16) | low);
 }
 
+/* Get the 64-bit monotonic uptime in jiffies.
+ * The 32-bit jiffies wrap after about 28 minutes. The bits above them
+ * are the carry out of jiffies_high16, which is counted by the overflow
+ * handler. So there is no per-pass cost.
+ * This is not for the hot path. Use the 32-bit jiffies and time_after()
+ * there. Must not be called from interrupt context.
+ */
+static inline uint64_t get_uptime(void)
+{
+	uint32_t now, wraps;
+	bool again;
+
+	do {
+		irq_disable();
+		wraps = jiffies_wraps;
+		irq_enable();
+		now = get_jiffies();
+		/* Retry, if the jiffies wrapped in between. */
+		irq_disable();
+		again = (wraps != jiffies_wraps);
+		irq_enable();
+	} while (unlikely(again));
+
+	return (U64(wraps) << 32) | now;
+}
+
 /* Put a 5ms signal onto the test pin. */
 static void jiffies_test(void)
 {
@@ -291,15 +574,694 @@ static const uint8_t bit2mask_lt[] = {
  */
 #define BITMASK(bitnr)	(__builtin_constant_p(bitnr) ? (1 << (bitnr)) : bit2mask_lt[(bitnr)])
 
+#define NR_CONNECTIONS		ARRAY_SIZE(connections)
+/* Number of bytes in a per-connection bitmap. */
+#define NR_CONNECTION_BYTES	((NR_CONNECTIONS + 7) / 8)
+
+/* Worst case scan loop cost estimates in CPU cycles.
+ * These are hand counted from the C source. They are NOT verified
+ * against the generated code or a cycle accurate simulator, so
+ * SCAN_CYCLES_MARGIN percent is added on top of them.
+ * Measure and update them, if the scan loop changes.
+ * SCAN_PASS_CYCLES is the work of every pass:
+ *   get_jiffies() 30, supervise() 70,
+ *   timeout setup 30, pulse_catch_fetch() 40, readback_check() 60,
+ *   odometer_flush() 40 (one counter), redundancy_check() 40,
+ *   storm window and idle checks 50.
+ * SCAN_PERIODIC_CYCLES is the work done at most once per pass and only
+ * once per window: storm_check() and the supervisor window. */
+#define SCAN_PASS_CYCLES	390
+#define SCAN_CONNECTION_CYCLES	130 /* scan_one_input_pin() with an edge and odometer_count() */
+#define SCAN_PERIODIC_CYCLES	(NR_CONNECTIONS * 30 + 60)
+#define SCAN_CYCLES_MARGIN	50 /* percent */
+#define __SCAN_MARGIN(cycles)	((cycles) * (100 + SCAN_CYCLES_MARGIN) / 100)
+#define SCAN_LOOP_CYCLES	__SCAN_MARGIN(SCAN_PASS_CYCLES + \
+				 NR_CONNECTIONS * SCAN_CONNECTION_CYCLES)
+#define SCAN_WORST_PASS_CYCLES	(SCAN_LOOP_CYCLES + \
+				 __SCAN_MARGIN(SCAN_PERIODIC_CYCLES))
+/* The minimum number of samples within ACTIVE_TIME. */
+#define SCAN_MIN_ACTIVE_SAMPLES	2
+
+/* Timeouts must fit into the signed half-range of the jiffies,
+ * because time_after() compares the sign of the difference. */
+#define USEC_FITS_JIFFIES(usec)	(U64(usec) * JIFFIES_PER_SECOND / U64(1000000) \
+				 <= U64(0x7FFFFFFF))
+
+/* Compile time validation of the target configuration. */
+compiletime_assert(NR_CONNECTIONS <= 0xFF,
+		   "Too many connections");
+compiletime_assert(USEC_FITS_JIFFIES(DEBOUNCE_ACTIVE_TIME),
+		   "DEBOUNCE_ACTIVE_TIME overflows the jiffies half-range");
+compiletime_assert(USEC_FITS_JIFFIES(DEBOUNCE_DWELL_TIME),
+		   "DEBOUNCE_DWELL_TIME overflows the jiffies half-range");
+compiletime_assert(USEC_FITS_JIFFIES(STORM_WINDOW),
+		   "STORM_WINDOW overflows the jiffies half-range");
+compiletime_assert(USEC_FITS_JIFFIES(DISCREPANCY_TIME),
+		   "DISCREPANCY_TIME overflows the jiffies half-range");
+compiletime_assert(USEC_FITS_JIFFIES(ODOMETER_FLUSH_TIME),
+		   "ODOMETER_FLUSH_TIME overflows the jiffies half-range");
+compiletime_assert(USEC_FITS_JIFFIES(READBACK_FILTER_TIME),
+		   "READBACK_FILTER_TIME overflows the jiffies half-range");
+compiletime_assert(USEC_FITS_JIFFIES(SAMPLE_BURST_TIME),
+		   "SAMPLE_BURST_TIME overflows the jiffies half-range");
+compiletime_assert(USEC_TO_JIFFIES(SAMPLE_IDLE_PERIOD) < 0x8000,
+		   "SAMPLE_IDLE_PERIOD exceeds the 16 bit hardware timer");
+TARGET_CONNECTIONS(__CHECK_PAIR)
+compiletime_assert(!(TARGET_PAIR_MASK & (TARGET_PAIR_MASK << 1)),
+		   "The second channel of an INPUT_PAIR has INPUT_PAIR, too");
+compiletime_assert(!(TARGET_INPUT_FLAGS & INPUT_CATCH) == !PULSE_CATCH,
+		   "PULSE_CATCH must be set, if and only if INPUT_CATCH is used");
+compiletime_assert(USEC_FITS_JIFFIES(SUPERVISE_ISR_WINDOW),
+		   "SUPERVISE_ISR_WINDOW overflows the jiffies half-range");
+#if !DEBUG
+compiletime_assert(U64(SAMPLE_IDLE_PERIOD) * TIME_DILATION <= SUPERVISE_WDT_TIMEOUT / 4,
+		   "The dilated SAMPLE_IDLE_PERIOD is too close to the watchdog timeout");
+compiletime_assert(U64(SUPERVISE_ISR_WINDOW) * TIME_DILATION <= SUPERVISE_WDT_TIMEOUT / 4,
+		   "The dilated SUPERVISE_ISR_WINDOW is too close to the watchdog timeout");
+#endif
+compiletime_assert(SUPERVISE_STALL_PASSES >= 2 && SUPERVISE_STALL_PASSES <= 0xFF,
+		   "Invalid SUPERVISE_STALL_PASSES");
+compiletime_assert(CYCLES_TO_JIFFIES(SUPERVISE_PASS_BUDGET) < 0xFFFF,
+		   "SUPERVISE_PASS_BUDGET exceeds 16 bit jiffies");
+compiletime_assert(U64(DEBOUNCE_ACTIVE_TIME) * CPU_HZ >=
+		   U64(SCAN_MIN_ACTIVE_SAMPLES) * SCAN_LOOP_CYCLES * 1000000,
+		   "DEBOUNCE_ACTIVE_TIME is too short for the scan loop period");
+
+/* Trace events.
+ * An event is emitted as a burst of as many pulses, as its number
+ * says. Keep this in sync with tracedecode.py. */
+enum trace_event {
+	TRACE_SCAN_START	= 1,	/* A scan pass starts. */
+	TRACE_EDGE		= 2,	/* A debounced input edge is accepted. */
+	TRACE_OUTPUT		= 3,	/* An output pin changes. */
+	TRACE_ISR_ENTRY		= 4,	/* An interrupt handler is entered. */
+	TRACE_ISR_EXIT		= 5,	/* An interrupt handler is left. */
+	TRACE_NR_EVENTS,
+};
+
+compiletime_assert((TRACE & ~((1 << TRACE_NR_EVENTS) - 1)) == 0,
+		   "TRACE enables unknown trace events");
+
+/* Emit a pulse code on the test pin.
+ * Each pulse is a single sbi/cbi pair. Interrupts are disabled, so the
+ * code of an interrupt handler can't end up in the middle of another
+ * one. */
+static inline void __trace(uint8_t event)
+{
+	uint8_t sreg = irq_disable_save();
+
+	do {
+		TEST_PORT |= (1 << TEST_BIT);
+		TEST_PORT &= (uint8_t)~(1 << TEST_BIT);
+	} while (--event);
+	__builtin_avr_delay_cycles(TRACE_GAP_CYCLES);
+	irq_restore(sreg);
+}
+
+#define trace(event)	do {				\
+		if (TRACE & (1 << (event)))		\
+			__trace(event);			\
+	} while (0)
+
+/* Interrupts that report progress to the supervisor. */
+enum supervise_isr {
+	SUPERVISE_EEPROM	= (1 << 0),
+	SUPERVISE_PROFILE	= (1 << 1),
+};
+
+/**
+ * struct supervisor - Watchdog supervision state
+ *
+ * @alive:		Interrupts that ran in the current window.
+ * @expected:		Interrupts that must run in the current window.
+ * @isr_ok:		All expected interrupts ran in the last window.
+ * @stall_passes:	Passes in a row without advancing jiffies (saturating).
+ * @window_end:		End of the current window.
+ */
+struct supervisor {
+	volatile uint8_t alive;
+	uint8_t expected;
+	bool isr_ok;
+	uint8_t stall_passes;
+	uint32_t window_end;
+};
+static struct supervisor supervisor = {
+	.isr_ok		= true,
+};
+
+/* Report interrupt progress. Only call this from interrupt context. */
+static inline void supervise_isr_alive(uint8_t isr)
+{
+	supervisor.alive |= isr;
+}
+
+#if PROFILE
+#ifdef PROFILE_SYMS
+# include PROFILE_SYMS
+#endif
+#ifndef PROFILE_SYMBOLS
+/* First build pass. The symbol table is not generated, yet. */
+# define PROFILE_SYMBOLS(SYM)
+# define PROFILE_NR_SYMBOLS	0
+#endif
+
+#ifndef OCR0A
+# error "The profiler needs timer 0 with compare match"
+#endif
+#ifdef __AVR_3_BYTE_PC__
+# error "The profiler only supports 16 bit program counters"
+#endif
+
+/* The timer runs at CPU_HZ / 1024. */
+#define PROFILE_OCR		(CPU_HZ / 1024 / PROFILE_HZ - 1)
+/* Cycles of the ISR stub around profile_sample(). */
+#define PROFILE_STUB_CYCLES	80
+
+compiletime_assert(PROFILE_OCR >= 1 && PROFILE_OCR <= 0xFF,
+		   "PROFILE_HZ is out of the timer 0 range");
+compiletime_assert((PROFILE_MAX_SYMBOLS & (PROFILE_MAX_SYMBOLS - 1)) == 0 &&
+		   PROFILE_MAX_SYMBOLS <= 128,
+		   "PROFILE_MAX_SYMBOLS must be a power of two up to 128");
+/* The last table entry is the end marker. */
+compiletime_assert(PROFILE_NR_SYMBOLS < PROFILE_MAX_SYMBOLS,
+		   "Too many symbols for PROFILE_MAX_SYMBOLS");
+
+/* Start addresses of the functions (in words), sorted.
+ * The unused entries are 0xFFFF. The table always has the same size, so
+ * both build passes have the same memory layout. */
+#define __PROFILE_SYM(index, addr, name)	[index] = (addr) / 2,
+static const uint16_t PROGMEM profile_syms[PROFILE_MAX_SYMBOLS] = {
+	PROFILE_SYMBOLS(__PROFILE_SYM)
+	[PROFILE_NR_SYMBOLS ... PROFILE_MAX_SYMBOLS - 1] = 0xFFFF,
+};
+
+/**
+ * struct profile - PC sampling profiler histogram
+ *
+ * Read this with a debugger or in the simulator, like the telemetry.
+ * profmap.py maps it to the function names.
+ *
+ * @hz:			The actual sampling rate.
+ * @samples:		Total number of samples.
+ * @isr_jiffies:	Jiffies measured in profile_sample(). One sample is
+ *			often shorter than a jiffy, but the samples are not
+ *			in phase with Timer 1, so the sum is still unbiased.
+ * @stub_cycles:	CPU cycles of the ISR stub per sample. These are
+ *			not measured and not included in @isr_jiffies.
+ * @hist:		Samples per function (saturating). Bin n is the
+ *			function n - 1 of the symbol table. Bin 0 is
+ *			below the first symbol.
+ */
+struct profile {
+	uint16_t hz;
+	uint32_t samples;
+	uint32_t isr_jiffies;
+	uint16_t stub_cycles;
+	uint16_t hist[PROFILE_MAX_SYMBOLS];
+};
+static struct profile profile __attribute__((__used__)) = {
+	.hz		= CPU_HZ / 1024 / (PROFILE_OCR + 1),
+	.stub_cycles	= PROFILE_STUB_CYCLES,
+};
+
+/* Bin one sample. Called from the ISR stub with the interrupted
+ * program counter (in words). */
+static void __attribute__((__used__, __noinline__, __noclone__))
+profile_sample(uint16_t pc)
+{
+	uint16_t start = TCNT1;
+	uint8_t bin = 0, step;
+
+	/* Count the symbols at or below pc. */
+	for (step = PROFILE_MAX_SYMBOLS / 2; step; step /= 2) {
+		if (pgm_read_word(&(profile_syms[bin + step - 1])) <= pc)
+			bin += step;
+	}
+	if (profile.hist[bin] != 0xFFFF)
+		profile.hist[bin]++;
+	profile.samples++;
+	supervise_isr_alive(SUPERVISE_PROFILE);
+	profile.isr_jiffies += (uint16_t)(TCNT1 - start);
+}
+
+/* Timer 0 compare match IRQ handler.
+ * This saves the call-clobbered registers, fetches the return address
+ * (the interrupted program counter) from the stack and calls
+ * profile_sample(). The return address is stored big-endian
+ * above the 15 saved registers. */
+#ifdef __AVR_HAVE_JMP_CALL__
+# define PROFILE_CALL	"call"
+#else
+# define PROFILE_CALL	"rcall"
+#endif
+#define PROFILE_ISR_NAME	stringify(TIMER0_COMPA_vect)
+__asm__(
+".text					\n"
+".global " PROFILE_ISR_NAME "		\n"
+PROFILE_ISR_NAME ":			\n"
+"	push r0				\n"
+"	in r0, __SREG__			\n"
+"	push r0				\n"
+"	push r1				\n"
+"	clr r1				\n"
+"	push r18			\n"
+"	push r19			\n"
+"	push r20			\n"
+"	push r21			\n"
+"	push r22			\n"
+"	push r23			\n"
+"	push r24			\n"
+"	push r25			\n"
+"	push r26			\n"
+"	push r27			\n"
+"	push r30			\n"
+"	push r31			\n"
+"	in r30, __SP_L__		\n"
+"	in r31, __SP_H__		\n"
+"	ldd r25, Z + 16			\n"
+"	ldd r24, Z + 17			\n"
+"	" PROFILE_CALL " profile_sample	\n"
+"	pop r31				\n"
+"	pop r30				\n"
+"	pop r27				\n"
+"	pop r26				\n"
+"	pop r25				\n"
+"	pop r24				\n"
+"	pop r23				\n"
+"	pop r22				\n"
+"	pop r21				\n"
+"	pop r20				\n"
+"	pop r19				\n"
+"	pop r18				\n"
+"	pop r1				\n"
+"	pop r0				\n"
+"	out __SREG__, r0		\n"
+"	pop r0				\n"
+"	reti				\n"
+".previous				\n"
+);
+
+static void setup_profile(void)
+{
+	TCCR0A = (1 << WGM01); /* CTC */
+	OCR0A = PROFILE_OCR;
+	TCCR0B = (1 << CS02) | (1 << CS00); /* CPU_HZ / 1024 */
+	TIMSK0 |= (1 << OCIE0A);
+}
+#else /* PROFILE */
+static inline void setup_profile(void) { }
+#endif /* PROFILE */
+
+/**
+ * struct connection_state - Runtime state of all connections
+ *
+ * This is a struct-of-arrays indexed by the connection number.
+ * The flags are bitmaps with the connection number (nr) being
+ * bit (nr % 8) in byte (nr / 8), so they can be tested and
+ * modified with single byte operations.
+ *
+ * @asserted:		The debounced input state.
+ * @pending:		The input differs from the debounced state
+ *			and the timeout is armed.
+ * @raw:		The raw input state of the last sample.
+ * @storm:		The input is demoted due to an event storm.
+ * @edge_count:		Raw edges in the current storm window (saturating).
+ * @timeout:		The ACTIVE_TIME or DWELL_TIME timeout.
+ *			Only valid, if the pending bit is set.
+ */
+struct connection_state {
+	uint8_t asserted[NR_CONNECTION_BYTES];
+	uint8_t pending[NR_CONNECTION_BYTES];
+	uint8_t raw[NR_CONNECTION_BYTES];
+	uint8_t storm[NR_CONNECTION_BYTES];
+	uint8_t edge_count[NR_CONNECTIONS];
+	uint32_t timeout[NR_CONNECTIONS];
+};
+static struct connection_state cstate;
+
+/* Pin change interrupt groups of the ATmega48/88/168/328.
+ * The groups are PORTB, PORTC and PORTD. The PCMSKx registers
+ * and the PCIEx bits are in the same order. */
+#define PCINT_GROUPS			3
+#define PORT_TO_PCINT_GROUP(port_addr)	(((port_addr) - _SFR_ADDR(PORTB)) / 3)
+#define PCINT_GROUP_TO_PCMSK(group)	(_SFR_ADDR(PCMSK0) + (group))
+
+/**
+ * struct pulse_catch - Pulse catching state
+ *
+ * @mask:		The INPUT_CATCH pins of each group.
+ * @invert:		The pins of each group that are asserted on low level.
+ * @seen:		Sticky bitmap of pins that were seen asserted by
+ *			the interrupt handler. Cleared by pulse_catch_fetch().
+ * @pass:		Snapshot of @seen for the current scan pass.
+ */
+struct pulse_catch {
+	uint8_t mask[PCINT_GROUPS];
+	uint8_t invert[PCINT_GROUPS];
+	uint8_t seen[PCINT_GROUPS];
+	uint8_t pass[PCINT_GROUPS];
+};
+static struct pulse_catch pulse_catch;
+
+#if PULSE_CATCH
+/* Latch the asserted INPUT_CATCH pins of a group.
+ * The pulse must still be there when the handler reads the pins.
+ * So the minimum pulse width is the interrupt latency. */
+static inline void pulse_catch_latch(uint8_t group, uint8_t pins)
+{
+	pulse_catch.seen[group] |= (pins ^ pulse_catch.invert[group]) &
+				   pulse_catch.mask[group];
+}
+
+ISR(PCINT0_vect)
+{
+	trace(TRACE_ISR_ENTRY);
+	pulse_catch_latch(0, PINB);
+	trace(TRACE_ISR_EXIT);
+}
+
+ISR(PCINT1_vect)
+{
+	trace(TRACE_ISR_ENTRY);
+	pulse_catch_latch(1, PINC);
+	trace(TRACE_ISR_EXIT);
+}
+
+ISR(PCINT2_vect)
+{
+	trace(TRACE_ISR_ENTRY);
+	pulse_catch_latch(2, PIND);
+	trace(TRACE_ISR_EXIT);
+}
+
+/* Enable or disable the pin change interrupt of an input. */
+static void pulse_catch_enable(const struct connection *conn, bool enable)
+{
+	uint8_t pcmsk = PCINT_GROUP_TO_PCMSK(PORT_TO_PCINT_GROUP(conn->in.input_port));
+
+	if (enable)
+		MMIO8(pcmsk) |= BITMASK(conn->in.input_bit);
+	else
+		MMIO8(pcmsk) &= ~BITMASK(conn->in.input_bit);
+}
+
+static void setup_pulse_catch(void)
+{
+	const struct connection *conn;
+	uint8_t i, group;
+
+	for (i = 0; i < NR_CONNECTIONS; i++) {
+		conn = &(connections[i]);
+		if (!(conn->in.flags & INPUT_CATCH))
+			continue;
+
+		group = PORT_TO_PCINT_GROUP(conn->in.input_port);
+		pulse_catch.mask[group] |= BITMASK(conn->in.input_bit);
+		if (!!(conn->in.flags & INPUT_PULLUP) ^ !!(conn->in.flags & INPUT_INVERT))
+			pulse_catch.invert[group] |= BITMASK(conn->in.input_bit);
+		pulse_catch_enable(conn, 1);
+		PCICR |= (1 << group);
+	}
+}
+
+/* Take the latched pulses for this scan pass. */
+static inline void pulse_catch_fetch(void)
+{
+	uint8_t i;
+
+	irq_disable();
+	for (i = 0; i < PCINT_GROUPS; i++) {
+		pulse_catch.pass[i] = pulse_catch.seen[i];
+		pulse_catch.seen[i] = 0;
+	}
+	irq_enable();
+}
+#else /* PULSE_CATCH */
+static inline void pulse_catch_enable(const struct connection *conn, bool enable) { }
+static inline void setup_pulse_catch(void) { }
+static inline void pulse_catch_fetch(void) { }
+#endif /* PULSE_CATCH */
+
+/**
+ * struct telemetry - Runtime statistics
+ *
+ * There is no communication link to the outside world, yet.
+ * So this can only be read with a debugger or in the simulator.
+ *
+ * @storm_count:	Number of event storms per connection (saturating).
+ * @sleep_jiffies:	Jiffies spent sleeping in idle sampling mode.
+ *			The CPU load is 1 - sleep_jiffies / elapsed jiffies.
+ * @readback_port:	The port of the last output readback mismatch.
+ * @readback_mismatch:	The mismatching pins of @readback_port.
+ * @pass_max:		The longest scan pass in jiffies (idle sleep excluded).
+ * @pass_overruns:	Scan passes over SUPERVISE_PASS_BUDGET (saturating).
+ */
+struct telemetry {
+	uint8_t storm_count[NR_CONNECTIONS];
+	uint32_t sleep_jiffies;
+	uint8_t readback_port;
+	uint8_t readback_mismatch;
+	uint16_t pass_max;
+	uint16_t pass_overruns;
+};
+static struct telemetry telemetry;
+
+/* Number of entries in the asynchronous EEPROM write queue. */
+#define EEPROM_QUEUE_LEN	4
+
+/**
+ * struct eeprom_job - An asynchronous EEPROM write
+ *
+ * @addr:	The next EEPROM address to write.
+ * @buf:	The next byte to write. The buffer must stay unchanged
+ *		until the job is done.
+ * @len:	The number of bytes left.
+ */
+struct eeprom_job {
+	uint16_t addr;
+	const uint8_t *buf;
+	uint8_t len;
+};
+
+/**
+ * struct eeprom_queue - The asynchronous EEPROM write queue
+ *
+ * The EE_READY interrupt writes one byte per interrupt. So writing
+ * the EEPROM never blocks the scan loop for the ~3.4 ms of a write.
+ *
+ * @jobs:	Ring of jobs.
+ * @head:	The job that is currently written.
+ * @count:	The number of queued jobs.
+ */
+struct eeprom_queue {
+	struct eeprom_job jobs[EEPROM_QUEUE_LEN];
+	uint8_t head;
+	volatile uint8_t count;
+};
+static struct eeprom_queue eeprom_queue;
+
+ISR(EE_READY_vect)
+{
+	struct eeprom_job *job = &(eeprom_queue.jobs[eeprom_queue.head]);
+
+	trace(TRACE_ISR_ENTRY);
+	supervise_isr_alive(SUPERVISE_EEPROM);
+	if (job->len) {
+		EEAR = job->addr++;
+		EEDR = *(job->buf++);
+		job->len--;
+		/* EEPE must be set within four cycles after EEMPE. */
+		EECR |= (1 << EEMPE);
+		EECR |= (1 << EEPE);
+	} else {
+		/* The last byte is written. This job is done. */
+		eeprom_queue.head = (eeprom_queue.head + 1) % EEPROM_QUEUE_LEN;
+		eeprom_queue.count--;
+		if (!eeprom_queue.count)
+			EECR &= ~(1 << EERIE);
+	}
+	trace(TRACE_ISR_EXIT);
+}
+
+/* Queue a write of len bytes from buf to the EEPROM address addr.
+ * Returns false, if the queue is full. */
+static inline bool eeprom_write_async(uint16_t addr, const void *buf, uint8_t len)
+{
+	struct eeprom_job *job;
+	uint8_t sreg;
+
+	if (eeprom_queue.count >= EEPROM_QUEUE_LEN)
+		return 0;
+
+	sreg = irq_disable_save();
+	job = &(eeprom_queue.jobs[(eeprom_queue.head + eeprom_queue.count) %
+				  EEPROM_QUEUE_LEN]);
+	job->addr = addr;
+	job->buf = buf;
+	job->len = len;
+	eeprom_queue.count++;
+	EECR |= (1 << EERIE);
+	irq_restore(sreg);
+
+	return 1;
+}
+
+#if ODOMETER
+/**
+ * struct odometer_record - An EEPROM record of the actuation counters
+ *
+ * @seq:	Sequence number. The valid record with the highest
+ *		sequence number is the current one.
+ * @count:	Number of assertions per connection.
+ * @csum:	Checksum. See odometer_csum().
+ */
+struct odometer_record {
+	uint16_t seq;
+	uint32_t count[NR_CONNECTIONS];
+	uint8_t csum;
+} __attribute__((__packed__));
+
+#define ODOMETER_SLOTS		(ODOMETER_EEPROM_SIZE / sizeof(struct odometer_record))
+#define ODOMETER_SLOT_ADDR(slot) \
+	(ODOMETER_EEPROM_BASE + (slot) * sizeof(struct odometer_record))
+
+compiletime_assert(sizeof(struct odometer_record) <= 0xFF,
+		   "The odometer record is too big for one EEPROM job");
+compiletime_assert(ODOMETER_SLOTS >= 2 && ODOMETER_SLOTS <= 0xFF,
+		   "Invalid number of odometer ring slots");
+compiletime_assert(ODOMETER_EEPROM_BASE + ODOMETER_EEPROM_SIZE <= E2END + 1,
+		   "The odometer ring exceeds the EEPROM");
+
+#define ODOMETER_IDLE		0xFF
+
+/**
+ * struct odometer - Actuation counters
+ *
+ * @count:	The current counters.
+ * @dirty:	The counters changed since the last flush.
+ * @slot:	The ring slot of the last record.
+ * @flush_time:	The earliest time of the next flush.
+ * @build:	The next counter to copy into the record,
+ *		or ODOMETER_IDLE.
+ * @record:	The record that is being built or written.
+ */
+struct odometer {
+	uint32_t count[NR_CONNECTIONS];
+	bool dirty;
+	uint8_t slot;
+	uint32_t flush_time;
+	uint8_t build;
+	struct odometer_record record;
+};
+static struct odometer odometer = {
+	.build		= ODOMETER_IDLE,
+};
+
+static uint8_t odometer_csum(const struct odometer_record *rec)
+{
+	const uint8_t *p = (const uint8_t *)rec;
+	uint8_t i, csum = 0x5A; /* An erased record is invalid. */
+
+	for (i = 0; i < offsetof(struct odometer_record, csum); i++)
+		csum += p[i];
+
+	return csum;
+}
+
+/* Restore the counters from the newest valid record in the ring.
+ * A record that was torn by a power loss fails the checksum, so we
+ * fall back to the one before it. */
+static void setup_odometer(void)
+{
+	struct odometer_record *rec = &(odometer.record);
+	uint8_t slot;
+	bool found = 0;
+	uint16_t seq = 0;
+
+	for (slot = 0; slot < ODOMETER_SLOTS; slot++) {
+		eeprom_read_block(rec, (const void *)ODOMETER_SLOT_ADDR(slot),
+				  sizeof(*rec));
+		if (rec->csum != odometer_csum(rec))
+			continue;
+		if (found && (int16_t)(rec->seq - seq) <= 0)
+			continue;
+		found = 1;
+		seq = rec->seq;
+		odometer.slot = slot;
+		memcpy(odometer.count, rec->count, sizeof(odometer.count));
+	}
+	if (!found)
+		odometer.slot = ODOMETER_SLOTS - 1;
+	rec->seq = seq;
+	odometer.flush_time = get_jiffies() + USEC_TO_JIFFIES(ODOMETER_FLUSH_TIME);
+}
+
+/* Count an assertion. This is all the scan loop does per edge. */
+static inline void odometer_count(uint8_t nr)
+{
+	odometer.count[nr]++;
+	odometer.dirty = 1;
+}
+
+/* Write the counters to the next ring slot, if they changed and
+ * the last flush is long enough ago.
+ * The record is built one counter per scan pass, so a flush never
+ * makes a pass much longer. */
+static void odometer_flush(uint32_t now)
+{
+	struct odometer_record *rec = &(odometer.record);
+	const uint8_t *p;
+	uint8_t i;
+
+	if (likely(odometer.build == ODOMETER_IDLE)) {
+		if (likely(!odometer.dirty) || time_before(now, odometer.flush_time))
+			return;
+		if (eeprom_queue.count)
+			return; /* Still writing. Try again next pass. */
+		/* Counts from now on go into the next flush. */
+		odometer.dirty = 0;
+		rec->seq++;
+		rec->csum = 0x5A + (uint8_t)rec->seq + (uint8_t)(rec->seq >> 8);
+		odometer.build = 0;
+		return;
+	}
+	if (odometer.build < NR_CONNECTIONS) {
+		i = odometer.build++;
+		rec->count[i] = odometer.count[i];
+		p = (const uint8_t *)&(rec->count[i]);
+		rec->csum += p[0] + p[1] + p[2] + p[3];
+		return;
+	}
+
+	if (!eeprom_write_async(ODOMETER_SLOT_ADDR((odometer.slot + 1) % ODOMETER_SLOTS),
+				rec, sizeof(*rec)))
+		return; /* Queue full. Try again next pass. */
+	odometer.slot = (odometer.slot + 1) % ODOMETER_SLOTS;
+	odometer.build = ODOMETER_IDLE;
+	odometer.flush_time = now + USEC_TO_JIFFIES(ODOMETER_FLUSH_TIME);
+}
+#else /* ODOMETER */
+static inline void setup_odometer(void) { }
+static inline void odometer_count(uint8_t nr) { }
+static inline void odometer_flush(uint32_t now) { }
+#endif /* ODOMETER */
+
 /* Set the hardware state of an output pin. */
 static inline void output_hw_set(struct output_pin *out, bool state)
 {
+	uint8_t sreg;
+
+	trace(TRACE_OUTPUT);
 	if (out->flags & OUTPUT_INVERT)
 		state = !state;
+	/* The read-modify-write must not be interrupted.
+	 * emergency_shutdown() may change the port from an ISR. */
+	sreg = irq_disable_save();
 	if (state)
 		MMIO8(out->output_port) |= BITMASK(out->output_bit);
 	else
 		MMIO8(out->output_port) &= ~BITMASK(out->output_bit);
+	irq_restore(sreg);
 }
 
 /* Increment the trigger level of an output. */
@@ -318,18 +1280,205 @@ static inline void output_level_dec(struct output_pin *out)
 		output_hw_set(out, 0);
 }
 
+#ifdef PORTA
+# define __IF_PORTA(x)	x
+#else
+# define __IF_PORTA(x)
+#endif
+#ifdef PORTB
+# define __IF_PORTB(x)	x
+#else
+# define __IF_PORTB(x)
+#endif
+#ifdef PORTC
+# define __IF_PORTC(x)	x
+#else
+# define __IF_PORTC(x)
+#endif
+#ifdef PORTD
+# define __IF_PORTD(x)	x
+#else
+# define __IF_PORTD(x)
+#endif
+/* Call func(port_addr) for each I/O port of the device. */
+#define for_each_port(func)				\
+	do {						\
+		__IF_PORTA(func(_SFR_ADDR(PORTA));)	\
+		__IF_PORTB(func(_SFR_ADDR(PORTB));)	\
+		__IF_PORTC(func(_SFR_ADDR(PORTC));)	\
+		__IF_PORTD(func(_SFR_ADDR(PORTD));)	\
+	} while (0)
+
+/* The mask of all output pins of a port.
+ * This is a compile time constant for a constant port. */
+#define __OUTPUT_MASK(portid, bit, _flags)			\
+	| ((_SFR_ADDR(PORT##portid) == port) ? BITMASK(bit) : 0)
+
+/* The safe state mask and value of an output port.
+ * These are compile time constants for a constant port. */
+#define __SAFE_STATE_MASK(portid, bit, _flags)			\
+	| ((_SFR_ADDR(PORT##portid) == port && ((_flags) & OUTPUT_SAFE)) ? \
+	   BITMASK(bit) : 0)
+#define __SAFE_STATE_VALUE(portid, bit, _flags)			\
+	| ((_SFR_ADDR(PORT##portid) == port && ((_flags) & OUTPUT_SAFE) && \
+	    !((_flags) & OUTPUT_INVERT)) ? BITMASK(bit) : 0)
+
+static inline void safe_state_apply(uint8_t port)
+{
+	uint8_t mask = 0 TARGET_OUTPUTS(__SAFE_STATE_MASK);
+	uint8_t value = 0 TARGET_OUTPUTS(__SAFE_STATE_VALUE);
+
+	/* One store per port. So all outputs switch in the same cycle. */
+	if (mask)
+		MMIO8(port) = (MMIO8(port) & ~mask) | value;
+}
+
+/* Put all OUTPUT_SAFE outputs into their asserted state.
+ * This is ISR-callable. The output port read-modify-writes in
+ * output_hw_set() run with interrupts disabled, so an interrupted
+ * one can't overwrite the safe state. */
+static void emergency_shutdown(void)
+{
+	uint8_t sreg = irq_disable_save();
+
+	for_each_port(safe_state_apply);
+	irq_restore(sreg);
+}
+
+static void major_fault(void)
+{
+	/* No interrupt may run anymore. The ISR trace points would
+	 * clear the fault indication on the test pin. */
+	irq_disable();
+	emergency_shutdown();
+	/* The fault is latched. Don't let the watchdog reset us. */
+	wdt_disable();
+	/* Pull test port high for failure indication. */
+	TEST_DDR |= (1 << TEST_BIT);
+	TEST_PORT |= (1 << TEST_BIT);
+	while (1);
+}
+
+/**
+ * struct readback - Output readback verification
+ *
+ * @mismatch:		A mismatch is pending.
+ * @deadline:		The time the pending mismatch becomes fatal.
+ */
+struct readback {
+	bool mismatch;
+	uint32_t deadline;
+};
+static struct readback readback;
+
+/* Compare the output pins of a port to what we drive.
+ * The PORTx register is the output image. */
+static inline uint8_t readback_port(uint8_t port)
+{
+	uint8_t mask = 0 TARGET_OUTPUTS(__OUTPUT_MASK);
+	uint8_t mismatch;
+
+	if (!mask)
+		return 0;
+	mismatch = (MMIO8(PORT_TO_PIN(port)) ^ MMIO8(port)) & mask;
+	if (unlikely(mismatch)) {
+		telemetry.readback_port = port;
+		telemetry.readback_mismatch = mismatch;
+	}
+
+	return mismatch;
+}
+
+#define __READBACK_PORT(port)	mismatch |= readback_port(port)
+
+/* Verify that all output pins follow their drivers.
+ * A shorted or stuck output that persists for longer than
+ * READBACK_FILTER_TIME is a major fault. */
+static void readback_check(uint32_t now)
+{
+	uint8_t mismatch = 0;
+
+	for_each_port(__READBACK_PORT);
+
+	if (likely(!mismatch)) {
+		readback.mismatch = 0;
+		return;
+	}
+	if (!readback.mismatch) {
+		readback.mismatch = 1;
+		readback.deadline = now + USEC_TO_JIFFIES(READBACK_FILTER_TIME);
+		return;
+	}
+	if (time_after(now, readback.deadline))
+		major_fault();
+}
+
+/**
+ * struct redundancy - Redundant pair cross-checking
+ *
+ * @pair_mask:		Connection bitmap of the first channels of the pairs.
+ * @discrepancy:	Bitmap of the pairs with a pending discrepancy.
+ * @deadline:		The time the pending discrepancy of the pair
+ *			becomes fatal. Indexed by the first channel.
+ */
+struct redundancy {
+	uint8_t pair_mask[NR_CONNECTION_BYTES];
+	uint8_t discrepancy[NR_CONNECTION_BYTES];
+	uint32_t deadline[NR_CONNECTIONS];
+};
+static struct redundancy redundancy;
+
+static void setup_redundancy(void)
+{
+	uint8_t i;
+
+	for (i = 0; i < NR_CONNECTIONS; i++) {
+		if (connections[i].in.flags & INPUT_PAIR)
+			redundancy.pair_mask[i / 8] |= BITMASK(i % 8);
+	}
+}
+
+/* Check the debounced states of all redundant pairs.
+ * This is bit-parallel: The first channels are compared with the
+ * second channels (the next bit) of a whole bitmap byte at once.
+ * Each pair has its own deadline. So one pair can't shorten or
+ * extend the DISCREPANCY_TIME of another one. */
+static void redundancy_check(uint32_t now)
+{
+	uint8_t i, nr, second, diff, start;
+
+	for (i = 0; i < NR_CONNECTION_BYTES; i++) {
+		second = cstate.asserted[i] >> 1;
+		if (i < NR_CONNECTION_BYTES - 1)
+			second |= cstate.asserted[i + 1] << 7;
+		diff = (cstate.asserted[i] ^ second) & redundancy.pair_mask[i];
+		start = diff & ~redundancy.discrepancy[i];
+		redundancy.discrepancy[i] = diff;
+		if (likely(!diff))
+			continue;
+
+		for (nr = i * 8; diff; nr++, diff >>= 1, start >>= 1) {
+			if (!(diff & 1))
+				continue;
+			if (start & 1)
+				redundancy.deadline[nr] = now + USEC_TO_JIFFIES(DISCREPANCY_TIME);
+			else if (time_after(now, redundancy.deadline[nr]))
+				major_fault(); /* The pair disagrees for too long. */
+		}
+	}
+}
+
 static void setup_ports(void)
 {
-	struct connection *conn;
+	const struct connection *conn;
 	uint8_t i;
-	uint32_t now = get_jiffies();
 
-	for (i = 0; i < ARRAY_SIZE(connections); i++) {
+	for (i = 0; i < NR_CONNECTIONS; i++) {
 		conn = &(connections[i]);
 
 		/* Init DDR registers */
-		MMIO8(conn->in.input_ddr) &= ~BITMASK(conn->in.input_bit);
-		MMIO8(conn->out->output_ddr) |= BITMASK(conn->out->output_bit);
+		MMIO8(PORT_TO_DDR(conn->in.input_port)) &= ~BITMASK(conn->in.input_bit);
+		MMIO8(PORT_TO_DDR(conn->out->output_port)) |= BITMASK(conn->out->output_bit);
 
 		/* Enable/Disable pullup */
 		if (conn->in.flags & INPUT_PULLUP)
@@ -340,103 +1489,337 @@ static void setup_ports(void)
 		/* Disable output signal */
 		conn->out->level = 0;
 		output_hw_set(conn->out, 0);
-
-		conn->input_is_asserted = 0;
-		conn->dwell_timeout = now + USEC_TO_JIFFIES(DEBOUNCE_ACTIVE_TIME);
 	}
+	/* All inputs start deasserted with no timeout pending. */
+	memset(&cstate, 0, sizeof(cstate));
 }
 
-static void scan_one_input_pin(struct connection *conn, uint32_t now)
+/**
+ * struct scan_pass - Timing of one scan pass
+ *
+ * @now:		The time of this pass.
+ * @active_timeout:	ACTIVE_TIME timeout for inputs that start to differ.
+ * @dwell_timeout:	DWELL_TIME timeout for inputs that start to differ.
+ *
+ * The timeouts are relative to the previous pass, because that was the
+ * last time the input was seen in its old state.
+ * They are computed once per pass instead of once per edge.
+ */
+struct scan_pass {
+	uint32_t now;
+	uint32_t active_timeout;
+	uint32_t dwell_timeout;
+};
+
+/* Scan connection number nr. mask is BITMASK(nr % 8). */
+static void scan_one_input_pin(const struct connection *conn,
+			       uint8_t nr, uint8_t mask,
+			       const struct scan_pass *pass)
 {
+	uint8_t idx = nr / 8;
 	uint8_t hw_input_asserted;
+	bool caught = false;
 
 	/* Get the input state */
-	hw_input_asserted = (MMIO8(conn->in.input_pin) & BITMASK(conn->in.input_bit));
+	hw_input_asserted = !!(MMIO8(PORT_TO_PIN(conn->in.input_port)) &
+			       BITMASK(conn->in.input_bit));
 	/* The hw input state meaning changes, if PULLUP xor INVERT is used.*/
 	if (!!(conn->in.flags & INPUT_PULLUP) ^ !!(conn->in.flags & INPUT_INVERT))
 		hw_input_asserted = !hw_input_asserted;
-
-	if (conn->input_is_asserted) {
-		/* Signal currently is asserted in software.
-		 * Try to detect !hw_input_asserted, but honor the dwell time. */
-		if (hw_input_asserted) {
-			/* The hardware pin is still active.
-			 * Restart the dwell time. */
-			conn->dwell_timeout = now + USEC_TO_JIFFIES(DEBOUNCE_DWELL_TIME);
-		}
-		if (hw_input_asserted || time_before(now, conn->dwell_timeout)) {
-			/* wait... */
-			return;
+	/* A pulse that was caught by the interrupt counts as asserted. */
+	if ((TARGET_INPUT_FLAGS & INPUT_CATCH) && (conn->in.flags & INPUT_CATCH)) {
+		if (pulse_catch.pass[PORT_TO_PCINT_GROUP(conn->in.input_port)] &
+		    BITMASK(conn->in.input_bit)) {
+			hw_input_asserted = 1;
+			caught = true;
 		}
-		conn->input_is_asserted = 0;
-		output_level_dec(conn->out);
-		conn->dwell_timeout = now + USEC_TO_JIFFIES(DEBOUNCE_ACTIVE_TIME);
+	}
+
+	/* Count the raw edges for the event storm detection. */
+	if (hw_input_asserted != !!(cstate.raw[idx] & mask)) {
+		cstate.raw[idx] ^= mask;
+		if (cstate.edge_count[nr] != 0xFF)
+			cstate.edge_count[nr]++;
+	}
+
+	if (hw_input_asserted == !!(cstate.asserted[idx] & mask)) {
+		/* The hardware pin agrees with the software state.
+		 * Cancel a pending timeout, if any. */
+		cstate.pending[idx] &= ~mask;
+		return;
+	}
+	if (!(cstate.pending[idx] & mask)) {
+		/* The hardware pin just started to differ.
+		 * Start the ACTIVE_TIME or DWELL_TIME. */
+		cstate.pending[idx] |= mask;
+		if (hw_input_asserted)
+			cstate.timeout[nr] = pass->active_timeout;
+		else
+			cstate.timeout[nr] = pass->dwell_timeout;
+	}
+	/* Pulses caught by the interrupt are taken immediately.
+	 * Polled samples always go through the ACTIVE_TIME. */
+	if (caught)
+		cstate.timeout[nr] = pass->now;
+	if (time_before(pass->now, cstate.timeout[nr])) {
+		/* wait... */
+		return;
+	}
+	cstate.pending[idx] &= ~mask;
+	cstate.asserted[idx] ^= mask;
+	trace(TRACE_EDGE);
+	if (hw_input_asserted) {
+		output_level_inc(conn->out);
+		odometer_count(nr);
 	} else {
-		/* Signal currently is _not_ asserted in software.
-		 * Try to detect hw_input_asserted, but honor the dwell time. */
-		if (!hw_input_asserted) {
-			/* The hardware pin still isn't active.
-			 * Restart the dwell time. */
-			conn->dwell_timeout = now + USEC_TO_JIFFIES(DEBOUNCE_ACTIVE_TIME);
+		output_level_dec(conn->out);
+	}
+}
+
+/* Evaluate the edge counts of the elapsed storm window
+ * and demote or promote the inputs accordingly.
+ * Storms are only summarized in the telemetry. Single edges are not. */
+static void storm_check(void)
+{
+	uint8_t i, idx, mask;
+	uint16_t edges;
+
+	for (i = 0; i < NR_CONNECTIONS; i++) {
+		idx = i / 8;
+		mask = BITMASK(i % 8);
+
+		edges = cstate.edge_count[i];
+		cstate.edge_count[i] = 0;
+
+		if (cstate.storm[idx] & mask) {
+			/* A demoted input only sees every
+			 * STORM_SCAN_DIVIDER'th sample. Extrapolate. */
+			edges *= STORM_SCAN_DIVIDER;
+			if (edges < STORM_EDGE_THRESHOLD / 2) {
+				/* Calmed down. Promote it. */
+				cstate.storm[idx] &= ~mask;
+				if (connections[i].in.flags & INPUT_CATCH)
+					pulse_catch_enable(&(connections[i]), 1);
+			}
+		} else if (edges >= STORM_EDGE_THRESHOLD) {
+			/* Demote it. A demoted input must not
+			 * flood us with pin change interrupts. */
+			cstate.storm[idx] |= mask;
+			if (connections[i].in.flags & INPUT_CATCH)
+				pulse_catch_enable(&(connections[i]), 0);
+			if (telemetry.storm_count[i] != 0xFF)
+				telemetry.storm_count[i]++;
 		}
-		if (!hw_input_asserted || time_before(now, conn->dwell_timeout)) {
-			/* wait... */
+	}
+}
+
+#if SAMPLE_IDLE_PERIOD
+/* Only used to wake up from the idle sleep. */
+EMPTY_INTERRUPT(TIMER1_COMPA_vect);
+
+static void setup_sampling(void)
+{
+	TIMSK1 |= (1 << OCIE1A);
+}
+
+/* Returns true, if any input differs from its debounced state. */
+static inline bool connections_busy(void)
+{
+	uint8_t i, pending = 0;
+
+	for (i = 0; i < NR_CONNECTION_BYTES; i++)
+		pending |= cstate.pending[i];
+
+	return pending != 0;
+}
+
+/* Sleep until the lower 16 bits of the jiffies reach the deadline.
+ * Any other interrupt (pin change) wakes us up early.
+ * Returns the jiffies slept. */
+static uint16_t sample_idle_sleep(uint16_t deadline)
+{
+	uint16_t start, slept = 0;
+
+	set_sleep_mode(SLEEP_MODE_IDLE);
+
+	/* 16 bit timer registers are accessed through the shared TEMP
+	 * register. The profiler interrupt reads TCNT1, so all 16 bit
+	 * accesses must be done with interrupts disabled. */
+	irq_disable();
+	OCR1A = deadline;
+	TIFR1 = (1 << OCF1A); /* Clear it */
+	start = TCNT1;
+	if ((int16_t)(deadline - start) > 0) {
+		sleep_enable();
+		/* The instruction after sei is executed before any
+		 * interrupt. So we can't miss the wakeup. */
+		irq_enable();
+		sleep_cpu();
+		sleep_disable();
+		irq_disable();
+		slept = TCNT1 - start;
+		telemetry.sleep_jiffies += slept;
+	}
+	irq_enable();
+
+	return slept;
+}
+#else /* SAMPLE_IDLE_PERIOD */
+static inline void setup_sampling(void) { }
+#endif /* SAMPLE_IDLE_PERIOD */
+
+/* Supervise the last scan pass and kick the watchdog.
+ * elapsed is the duration of the pass and slept the idle sleep in it. */
+static void supervise(uint32_t now, uint32_t elapsed, uint16_t slept)
+{
+	uint8_t alive;
+	uint16_t busy;
+
+	/* A stalled time base freezes all timeouts. Stop kicking. */
+	if (unlikely(elapsed == 0)) {
+		if (supervisor.stall_passes < SUPERVISE_STALL_PASSES)
+			supervisor.stall_passes++;
+		if (supervisor.stall_passes >= SUPERVISE_STALL_PASSES)
 			return;
-		}
-		conn->input_is_asserted = 1;
-		output_level_inc(conn->out);
-		conn->dwell_timeout = now + USEC_TO_JIFFIES(DEBOUNCE_DWELL_TIME);
+	} else {
+		supervisor.stall_passes = 0;
+	}
+
+	if (unlikely(time_after(now, supervisor.window_end))) {
+		irq_disable();
+		alive = supervisor.alive;
+		supervisor.alive = 0;
+		irq_enable();
+		supervisor.isr_ok = ((alive & supervisor.expected) == supervisor.expected);
+
+		/* The EEPROM interrupt only runs while there are jobs. */
+		supervisor.expected = 0;
+		if (PROFILE)
+			supervisor.expected |= SUPERVISE_PROFILE;
+		if (eeprom_queue.count)
+			supervisor.expected |= SUPERVISE_EEPROM;
+		supervisor.window_end = now + USEC_TO_JIFFIES(SUPERVISE_ISR_WINDOW);
+	}
+
+	/* Saturate. A truncated duration could look within budget. */
+	elapsed -= min(elapsed, slept);
+	busy = min(elapsed, U32(0xFFFF));
+	if (unlikely(busy > telemetry.pass_max))
+		telemetry.pass_max = busy;
+	if (unlikely(busy > CYCLES_TO_JIFFIES(SUPERVISE_PASS_BUDGET))) {
+		if (telemetry.pass_overruns != 0xFFFF)
+			telemetry.pass_overruns++;
+		return;
 	}
+	if (likely(supervisor.isr_ok))
+		wdt_reset();
 }
 
 static void scan_input_pins(void)
 {
-	uint8_t i;
-	uint32_t now;
+	struct scan_pass pass;
+	uint8_t i, mask;
+	uint8_t pass_count = 0;
+	uint32_t prev;
+	uint32_t storm_window_end;
+	uint16_t slept = 0;
+#if SAMPLE_IDLE_PERIOD
+	bool idle = 0;
+	uint32_t burst_end;
+#endif
 
+	pass.now = get_jiffies();
+	storm_window_end = pass.now + USEC_TO_JIFFIES(STORM_WINDOW);
+#if SAMPLE_IDLE_PERIOD
+	burst_end = pass.now + USEC_TO_JIFFIES(SAMPLE_BURST_TIME);
+#endif
 	while (1) {
-		now = get_jiffies();
-		for (i = 0; i < ARRAY_SIZE(connections); i++) {
-			scan_one_input_pin(&(connections[i]), now);
-			wdt_reset();
+		prev = pass.now;
+		trace(TRACE_SCAN_START);
+		pass.now = get_jiffies();
+		supervise(pass.now, pass.now - prev, slept);
+#if SAMPLE_IDLE_PERIOD
+		/* After an idle sleep the previous pass is too long ago to
+		 * be the start of a timeout. Start the timeouts now, so they
+		 * are as accurate as in burst mode. */
+		if (idle)
+			prev = pass.now;
+#endif
+		pass.active_timeout = prev + USEC_TO_JIFFIES(DEBOUNCE_ACTIVE_TIME);
+		pass.dwell_timeout = prev + USEC_TO_JIFFIES(DEBOUNCE_DWELL_TIME);
+		if (TARGET_INPUT_FLAGS & INPUT_CATCH)
+			pulse_catch_fetch();
+		pass_count++;
+		mask = 0x01;
+		for (i = 0; i < NR_CONNECTIONS; i++) {
+			/* Demoted inputs are only sampled at a low rate. */
+			if (likely(!(cstate.storm[i / 8] & mask)) ||
+			    !(pass_count & (STORM_SCAN_DIVIDER - 1)))
+				scan_one_input_pin(&(connections[i]), i, mask, &pass);
+			mask = (mask << 1) | (mask >> 7);
+		}
+		readback_check(pass.now);
+		odometer_flush(pass.now);
+		if (TARGET_INPUT_FLAGS & INPUT_PAIR)
+			redundancy_check(pass.now);
+		if (unlikely(time_after(pass.now, storm_window_end))) {
+			storm_check();
+			storm_window_end = pass.now + USEC_TO_JIFFIES(STORM_WINDOW);
 		}
+#if SAMPLE_IDLE_PERIOD
+		if (connections_busy())
+			burst_end = pass.now + USEC_TO_JIFFIES(SAMPLE_BURST_TIME);
+		idle = time_after(pass.now, burst_end);
+		if (idle) {
+			burst_end = pass.now; /* Don't let it wrap. */
+			slept = sample_idle_sleep(pass.now + USEC_TO_JIFFIES(SAMPLE_IDLE_PERIOD));
+		} else {
+			slept = 0;
+		}
+#endif
 #if 0
 		TEST_PORT ^= (1 << TEST_BIT);
 #endif
 	}
 }
 
-static void major_fault(void)
-{
-	emergency_shutdown();
-	/* Pull test port high for failure indication. */
-	TEST_DDR |= (1 << TEST_BIT);
-	TEST_PORT |= (1 << TEST_BIT);
-	while (1);
-}
-
 int main(void)
 {
+	uint8_t mcusr;
+
 	irq_disable();
 	TEST_DDR |= (1 << TEST_BIT);
 	TEST_PORT &= ~(1 << TEST_BIT);
 
+	/* Export the scan pass estimate as an absolute symbol for the
+	 * build matrix report (make matrix). This emits no code. */
+	__asm__ __volatile__(".global scan_worst_pass_cycles\n"
+			     ".set scan_worst_pass_cycles, %0"
+			     : : "i" (SCAN_WORST_PASS_CYCLES));
+
 	setup_jiffies();
 	setup_ports();
+	setup_sampling();
+	setup_odometer();
+	if (TARGET_INPUT_FLAGS & INPUT_PAIR)
+		setup_redundancy();
+	if (TARGET_INPUT_FLAGS & INPUT_CATCH)
+		setup_pulse_catch();
+	setup_profile();
 
-#if 0
 	/* Check if we had a major fault. */
-	if (!(MCUSR & (1 << PORF))) {
-		if (MCUSR & (1 << WDRF))
+	mcusr = MCUSR;
+	MCUSR = 0; /* WDRF must be clear to disable the watchdog. */
+	if (!(mcusr & (1 << PORF))) {
+		if (mcusr & (1 << WDRF))
 			major_fault(); /* Watchdog triggered */
 	}
-	MCUSR = 0;
 
+	/* The watchdog is kicked by supervise() only. */
 #if !DEBUG
 	wdt_enable(WDTO_500MS);
 #endif
 	wdt_reset();
-#endif
 
 	irq_enable();
 	scan_input_pins();
@@ -0,0 +1,84 @@
+#!/usr/bin/env python3
+#
+# Map the PC sampling profiler histogram to function names.
+# See "PC sampling profiler" in main.c.
+#
+# The histogram is a raw dump of struct profile. With avr-gdb:
+#   (gdb) dump binary value profile.bin profile
+# Then:
+#   ./profmap.py profile_syms.h profile.bin
+#
+
+import argparse
+import re
+import struct
+import sys
+
+
+def read_symbols(path):
+	names = {}
+	with open(path) as f:
+		for line in f:
+			m = re.match(r"\s*SYM\((\d+),\s*(0x[0-9a-fA-F]+),\s*([^)\s]+)\)", line)
+			if m:
+				names[int(m.group(1))] = (int(m.group(2), 16), m.group(3))
+	return names
+
+
+def main():
+	p = argparse.ArgumentParser(description="Map the debouncer profiler histogram to functions")
+	p.add_argument("symbols", help="The generated profile_syms.h")
+	p.add_argument("dump", help="Raw dump of struct profile")
+	p.add_argument("--cpu-mhz", type=float, default=20.0,
+		       help="CPU clock of the target in MHz (default 20)")
+	p.add_argument("--time-dilation", type=int, default=1,
+		       help="TIME_DILATION of the firmware (default 1)")
+	args = p.parse_args()
+
+	names = read_symbols(args.symbols)
+	with open(args.dump, "rb") as f:
+		data = f.read()
+
+	# struct profile: uint16 hz, uint32 samples, uint32 isr_jiffies,
+	# uint16 stub_cycles, uint16 hist[PROFILE_MAX_SYMBOLS].
+	# Little endian, not padded.
+	hz, samples, isr_jiffies, stub_cycles = struct.unpack_from("<HIIH", data, 0)
+	nr_bins = (len(data) - 12) // 2
+	hist = struct.unpack_from("<%dH" % nr_bins, data, 12)
+	if not samples:
+		sys.exit("No samples")
+
+	rows = []
+	for i, count in enumerate(hist):
+		if not count:
+			continue
+		if i == 0:
+			name = "(below the first symbol)"
+		elif i - 1 in names:
+			name = "%s (0x%04x)" % (names[i - 1][1], names[i - 1][0])
+		else:
+			name = "(bin %d, unknown symbol)" % i
+		rows.append((count, name))
+	rows.sort(reverse=True)
+
+	total = sum(hist)
+	for count, name in rows:
+		print("%8d %6.2f%%  %s" % (count, count * 100.0 / total, name))
+	if any(count == 0xFFFF for count in hist):
+		print("Warning: saturated bins. The percentages are not exact.")
+
+	# The timer of the jiffies runs at CPU_HZ / 8 / TIME_DILATION.
+	# The profiler timer is not dilated. The stub is counted in
+	# cycles, so it is converted here instead of once per sample.
+	cpu_hz = args.cpu_mhz * 1e6
+	jiffies_per_second = cpu_hz / 8 / args.time_dilation
+	isr_time = isr_jiffies / jiffies_per_second + samples * stub_cycles / cpu_hz
+	elapsed = samples / float(hz)
+	print("")
+	print("%d samples at %d Hz (%.1f s)" % (samples, hz, elapsed))
+	print("Profiler overhead %.2f%% (%.1f us per sample)" %
+	      (isr_time / elapsed * 100.0, isr_time / samples * 1e6))
+
+
+if __name__ == "__main__":
+	main()
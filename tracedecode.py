@@ -0,0 +1,179 @@
+#!/usr/bin/env python3
+#
+# Decode the trace point pulse codes captured from the test pin.
+# See "Trace points" in main.c.
+#
+# The capture is either a CSV file with "time,level" rows (time in
+# seconds, as exported by sigrok-cli -O csv or most logic analyzers)
+# or a VCD file.
+#
+# Example:
+#   sigrok-cli -d fx2lafw -c samplerate=24m --time 2s -P logic -O csv > cap.csv
+#   ./tracedecode.py --cpu-mhz 20 cap.csv
+#
+
+import argparse
+import sys
+
+# Keep this in sync with enum trace_event in main.c.
+EVENTS = {
+	1: "SCAN_START",
+	2: "EDGE",
+	3: "OUTPUT",
+	4: "ISR_ENTRY",
+	5: "ISR_EXIT",
+}
+
+# A pin held high for longer than this is major_fault().
+FAULT_CYCLES = 1000
+
+
+def read_csv(f):
+	edges = []
+	for line in f:
+		line = line.strip()
+		if not line or line.startswith(";") or line.startswith("#"):
+			continue
+		fields = line.split(",")
+		try:
+			t = float(fields[0])
+			level = int(fields[-1])
+		except ValueError:
+			continue # Header row
+		edges.append((t, level))
+	return edges
+
+
+def read_vcd(f, signal):
+	scale = {"s": 1.0, "ms": 1e-3, "us": 1e-6, "ns": 1e-9, "ps": 1e-12, "fs": 1e-15}
+	timescale = 1e-9
+	ident = None
+	t = 0
+	edges = []
+	tokens = f.read().split()
+	i = 0
+	while i < len(tokens):
+		tok = tokens[i]
+		if tok == "$timescale":
+			spec = ""
+			i += 1
+			while tokens[i] != "$end":
+				spec += tokens[i]
+				i += 1
+			num = spec.rstrip("fpnumsc")
+			unit = spec[len(num):]
+			timescale = float(num or 1) * scale[unit]
+		elif tok == "$var":
+			# $var wire 1 <id> <name> $end
+			if ident is None and (signal is None or tokens[i + 4] == signal):
+				ident = tokens[i + 3]
+			i += 5
+		elif tok.startswith("#"):
+			t = int(tok[1:]) * timescale
+		elif ident is not None and tok[0] in "01xXzZ" and tok[1:] == ident:
+			edges.append((t, 1 if tok[0] == "1" else 0))
+		i += 1
+	if ident is None:
+		sys.exit("Signal not found in the VCD file")
+	return edges
+
+
+def pulses(edges):
+	"""Convert level samples into (start, width) of high pulses."""
+	prev = 0
+	start = None
+	for t, level in edges:
+		if level and not prev:
+			start = t
+		elif not level and prev and start is not None:
+			yield (start, t - start)
+		prev = level
+	if prev and start is not None:
+		yield (start, None) # Still high at the end
+
+
+def decode(edges, cycle, gap_cycles):
+	"""Group the pulses into codes. Yields (time, event name)."""
+	# Within a code the pulses are a few cycles apart.
+	# Codes are separated by at least gap_cycles.
+	split = (gap_cycles + 6) / 2 * cycle
+	code_start = None
+	code_len = 0
+	last_end = None
+	for start, width in pulses(edges):
+		if width is None or width > FAULT_CYCLES * cycle:
+			if code_len:
+				yield (code_start, code_len)
+				code_len = 0
+			yield (start, "FAULT")
+			continue
+		if code_len and start - last_end > split:
+			yield (code_start, code_len)
+			code_len = 0
+		if not code_len:
+			code_start = start
+		code_len += 1
+		last_end = start + width
+	if code_len:
+		yield (code_start, code_len)
+
+
+def main():
+	p = argparse.ArgumentParser(description="Decode debouncer trace point pulse codes")
+	p.add_argument("capture", help="CSV or VCD capture of the test pin")
+	p.add_argument("--cpu-mhz", type=float, default=20.0,
+		       help="CPU clock of the target in MHz (default 20)")
+	p.add_argument("--gap-cycles", type=int, default=16,
+		       help="TRACE_GAP_CYCLES of the firmware (default 16)")
+	p.add_argument("--signal", help="VCD signal name (default: the first one)")
+	p.add_argument("--summary", action="store_true",
+		       help="Only print the statistics")
+	args = p.parse_args()
+
+	cycle = 1e-6 / args.cpu_mhz
+	with open(args.capture) as f:
+		if args.capture.endswith(".vcd"):
+			edges = read_vcd(f, args.signal)
+		else:
+			edges = read_csv(f)
+
+	counts = {}
+	scan_periods = []
+	isr_times = []
+	last_scan = None
+	isr_entry = None
+	t0 = None
+	prev = None
+	for t, code in decode(edges, cycle, args.gap_cycles):
+		if isinstance(code, int):
+			name = EVENTS.get(code, "UNKNOWN(%d)" % code)
+		else:
+			name = code
+		if t0 is None:
+			t0 = prev = t
+		if not args.summary:
+			print("%14.3f us  %+12.3f us  %s" % ((t - t0) * 1e6, (t - prev) * 1e6, name))
+		prev = t
+		counts[name] = counts.get(name, 0) + 1
+		if name == "SCAN_START":
+			if last_scan is not None:
+				scan_periods.append(t - last_scan)
+			last_scan = t
+		elif name == "ISR_ENTRY":
+			isr_entry = t
+		elif name == "ISR_EXIT" and isr_entry is not None:
+			isr_times.append(t - isr_entry)
+			isr_entry = None
+
+	print("")
+	for name in sorted(counts):
+		print("%-12s %8d" % (name, counts[name]))
+	for title, values in (("scan period", scan_periods), ("ISR time", isr_times)):
+		if values:
+			print("%-12s min %.3f us  avg %.3f us  max %.3f us" %
+			      (title, min(values) * 1e6,
+			       sum(values) / len(values) * 1e6, max(values) * 1e6))
+
+
+if __name__ == "__main__":
+	main()
@@ -29,6 +29,13 @@
 #define __stringify(x)		#x
 #define stringify(x)		__stringify(x)
 
+/* Concatenate two tokens after expanding them */
+#define __concat(a, b)		a##b
+#define concat(a, b)		__concat(a, b)
+
+/* Fail to compile, if the constant condition is false. */
+#define compiletime_assert(condition, msg)	_Static_assert(condition, msg)
+
 typedef _Bool		bool;
 #define true		((bool)(!!1))
 #define false		((bool)(!!0))